@@ -0,0 +1,44 @@
+# Check data memory use from the XC8 memory summary against a RAM budget.
+# Run with cmake -DSUMMARY=<memoryfile.xml> -DOUTPUT=<elf> [-DRAM_BUDGET=<bytes>] -P
+# RAM_BUDGET defaults to the device's data memory size from the summary.
+# On failure the ELF and the HEX written next to it are removed, so an image
+# that was never checked can't be programmed by mistake.
+
+get_filename_component(OUTPUT_DIR "${OUTPUT}" DIRECTORY)
+get_filename_component(OUTPUT_NAME "${OUTPUT}" NAME_WE)
+set(HEX_FILE "${OUTPUT_DIR}/${OUTPUT_NAME}.hex")
+
+macro(fail_check)
+    file(REMOVE "${OUTPUT}" "${HEX_FILE}")
+    message(FATAL_ERROR ${ARGN})
+endmacro()
+
+if(NOT EXISTS "${SUMMARY}")
+    fail_check("Memory summary ${SUMMARY} not found, can't check the RAM budget")
+endif()
+
+# Expected layout (xc8-cc -Wl,--memorysummary):
+#   <memory name="data"> ... <length>128</length> <used>..</used> ... </memory>
+file(READ "${SUMMARY}" XML)
+string(REGEX MATCH "<memory name=\"data\"[^>]*>.*</memory>" DATA_MEM "${XML}")
+string(REGEX MATCH "<used>[ \t]*([0-9A-Fa-fx]+)[ \t]*</used>" _ "${DATA_MEM}")
+set(USED "${CMAKE_MATCH_1}")
+string(REGEX MATCH "<length>[ \t]*([0-9A-Fa-fx]+)[ \t]*</length>" _ "${DATA_MEM}")
+set(LENGTH "${CMAKE_MATCH_1}")
+
+if(USED STREQUAL "" OR LENGTH STREQUAL "")
+    fail_check("No data memory usage found in ${SUMMARY}, can't check the RAM budget. "
+        "If the summary format changed, update check_ram.cmake.")
+endif()
+
+math(EXPR USED "${USED}")
+math(EXPR LENGTH "${LENGTH}")
+if(NOT RAM_BUDGET)
+    set(RAM_BUDGET ${LENGTH})
+endif()
+
+if(USED GREATER RAM_BUDGET)
+    fail_check("Data memory ${USED} bytes exceeds RAM budget of ${RAM_BUDGET} bytes "
+        "(device has ${LENGTH}). Reduce BUFFER_SIZE or CMD_BUFFER_SIZE.")
+endif()
+message(STATUS "Data memory: ${USED} of ${RAM_BUDGET} bytes budgeted (device has ${LENGTH})")
@@ -28,6 +28,7 @@
 
 #include "keymap.h"
 #include "ps2_send.h"
+#include "macro.h"
 #include <stdint.h>
 
 // PS/2 Scan Code Set 2 - Input scancodes for modifier key detection
@@ -60,7 +61,7 @@ const Keymap EN_US = {
     {
         0,  F9, 0, F5, F3, F1, F2, F12,
         0, F10, F8, F6, F4, TAB, '`', 0,
-        0, 0, 0, 0, 0, 'q', '1', 0,
+        0, ALT_L, 0, 0, CTRL_L, 'q', '1', 0,
         0, 0, 'z', 's', 'a', 'w', '2', 0,
         0, 'c', 'x', 'd', 'e', '4', '3', 0,
         0, ' ', 'v', 'f', 't', 'r', '5', 0,
@@ -79,7 +80,7 @@ const Keymap EN_US = {
     {
         0, F9, 0, F5, F3, F1, F2, F12,
         0, F10, F8, F6, F4, TAB, '~', 0,
-        0, 0, 0, 0, 0, 'Q', '!', 0,
+        0, ALT_L, 0, 0, CTRL_L, 'Q', '!', 0,
         0, 0, 'Z', 'S', 'A', 'W', '@', 0,
         0, 'C', 'X', 'D', 'E', '$', '#', 0,
         0, ' ', 'V', 'F', 'T', 'R', '%', 0,
@@ -98,42 +99,108 @@ const Keymap EN_US = {
 };
 
 // Modifier bit flags for modifiers variable
-#define BREAK       0b0001
-#define EXTEND      0b0010
-#define SHIFT_L_BIT 0b0100
-#define SHIFT_R_BIT 0b1000
+// Lock bits are in LED order (scroll, num, caps) from LOCK_SHIFT
+#define BREAK       0b00000001
+#define EXTEND      0b00000010
+#define SHIFT_L_BIT 0b00000100
+#define SHIFT_R_BIT 0b00001000
+#define SCROLL_BIT  0b00010000
+#define NUM_BIT     0b00100000
+#define CAPS_BIT    0b01000000
+#define RELEASE_ALL 0b10000000  // Synthetic releases pending
+#define LOCK_SHIFT  4
+
+// Pressed-key bitmap, one bit per special key code (F1..PAUSE)
+#define KEY_STATE_SIZE ((PAUSE - F1) / 8 + 1)
 
 // Static state that persists across calls
+// releaseAllKeys() may run outside the ISR; it only sets one bit (atomic bsf)
 static uint8_t modifier_flags = 0;
-static uint8_t caps_lock = 0;
-static uint8_t num_lock = 0;
-static uint8_t scroll_lock = 0;
+static uint8_t key_state[KEY_STATE_SIZE];
+static uint8_t macro_key = 0;  // F-key held down that triggered a macro
 
 static void updateLEDs(void) {
-    uint8_t led_byte = (uint8_t)((scroll_lock) | (num_lock << 1) | (caps_lock << 2));
+    uint8_t led_byte = (uint8_t)((modifier_flags >> LOCK_SHIFT) & 0x07);
     ps2_setLEDs(led_byte);
 }
 
+// Modifier and lock keys only change host state once per press
+static uint8_t isModifier(uint8_t c) {
+    return (c >= CAPS && c <= MENU) || c == NUM || c == SCROL;
+}
+
+static uint8_t isKeyDown(uint8_t c) {
+    uint8_t idx = c - F1;
+    return key_state[idx >> 3] & (uint8_t)(1 << (idx & 7));
+}
+
+// Ctrl+F-key types a macro instead. Returns 1 if the key was consumed.
+static uint8_t checkMacro(uint8_t c, uint8_t is_release) {
+    if (c == macro_key) {
+        // Swallow typematic repeats and the release of the trigger key
+        if (is_release) macro_key = 0;
+        return 1;
+    }
+    if (is_release || c < F1 || c > F12) return 0;
+    if (!isKeyDown(CTRL_L) && !isKeyDown(CTRL_R)) return 0;
+    if (!macro_start(c - F1)) return 0;
+    macro_key = c;
+    return 1;
+}
+
+// Special key press. Returns -1 for typematic repeats of modifiers.
+// key_state only changes in commitKeyEvent(), once the event is buffered.
+static int pressKey(uint8_t c) {
+    if (isKeyDown(c) && isModifier(c)) {
+        return -1;
+    }
+    return c;
+}
+
+// Special key release. Returns -1 if the host never saw it down.
+static int releaseKey(uint8_t c) {
+    if (!isKeyDown(c)) {
+        return -1;
+    }
+    return c | 0x40;
+}
+
+// Match our lock state to the LEDs ps2_initKeyboard() sets (num lock on)
+#pragma warning push
+#pragma warning disable 1510
+void initKeyboard(void) {
+    modifier_flags &= ~(CAPS_BIT | SCROLL_BIT);
+    modifier_flags |= NUM_BIT;
+    ps2_initKeyboard();
+}
+#pragma warning pop
+
 static int get8859Code(uint8_t code) {
-    if (!code) return 0;
     int c;
 
+    // Keyboard buffer overrun - break codes may have been lost
+    if (!code || code == 0xFF) {
+        releaseAllKeys();
+        return -1;
+    }
+
     // Handle keyboard power-on/reset (BAT complete)
     if (code == 0xAA) {
-        num_lock = 1;
-        ps2_initKeyboard();
+        releaseAllKeys();
+        initKeyboard();
         return -1;
     }
 
     // Handle BAT fail - attempt reset
     if (code == 0xFC) {
+        releaseAllKeys();
         ps2_reset();
         return -1;
     }
 
     // Ignore other PS/2 status bytes
     if (code == 0xEE || code == 0xFA ||
-        code == 0xFD || code == 0xFE || code == 0xFF) {
+        code == 0xFD || code == 0xFE) {
         return -1;
     }
 
@@ -154,49 +221,59 @@ static int get8859Code(uint8_t code) {
         // Handle state-modifying keys (shift, lock keys)
         if (!is_release) {
             // Press events
+            // Lock keys only toggle on the first make, not typematic repeats
             if (code == PS2_LSHIFT) {
                 modifier_flags |= SHIFT_L_BIT;
                 modifier_flags &= ~(BREAK | EXTEND);
-                return SHIFT_L;
+                return pressKey(SHIFT_L);
             } else if (code == PS2_RSHIFT) {
                 modifier_flags |= SHIFT_R_BIT;
                 modifier_flags &= ~(BREAK | EXTEND);
-                return SHIFT_R;
+                return pressKey(SHIFT_R);
             } else if (code == PS2_CAPS) {
-                caps_lock ^= 1;
-                updateLEDs();
                 modifier_flags &= ~(BREAK | EXTEND);
-                return CAPS;
+                c = pressKey(CAPS);
+                if (c != -1) {
+                    modifier_flags ^= CAPS_BIT;
+                    updateLEDs();
+                }
+                return c;
             } else if (code == PS2_NUM) {
-                num_lock ^= 1;
-                updateLEDs();
                 modifier_flags &= ~(BREAK | EXTEND);
-                return NUM;
+                c = pressKey(NUM);
+                if (c != -1) {
+                    modifier_flags ^= NUM_BIT;
+                    updateLEDs();
+                }
+                return c;
             } else if (code == PS2_SCROLL) {
-                scroll_lock ^= 1;
-                updateLEDs();
                 modifier_flags &= ~(BREAK | EXTEND);
-                return SCROL;
+                c = pressKey(SCROL);
+                if (c != -1) {
+                    modifier_flags ^= SCROLL_BIT;
+                    updateLEDs();
+                }
+                return c;
             }
         } else {
             // Release events
             if (code == PS2_LSHIFT) {
                 modifier_flags &= ~SHIFT_L_BIT;
                 modifier_flags &= ~(BREAK | EXTEND);
-                return SHIFT_L | 0x40;
+                return releaseKey(SHIFT_L);
             } else if (code == PS2_RSHIFT) {
                 modifier_flags &= ~SHIFT_R_BIT;
                 modifier_flags &= ~(BREAK | EXTEND);
-                return SHIFT_R | 0x40;
+                return releaseKey(SHIFT_R);
             } else if (code == PS2_CAPS) {
                 modifier_flags &= ~(BREAK | EXTEND);
-                return CAPS | 0x40;
+                return releaseKey(CAPS);
             } else if (code == PS2_NUM) {
                 modifier_flags &= ~(BREAK | EXTEND);
-                return NUM | 0x40;
+                return releaseKey(NUM);
             } else if (code == PS2_SCROLL) {
                 modifier_flags &= ~(BREAK | EXTEND);
-                return SCROL | 0x40;
+                return releaseKey(SCROL);
             }
         }
 
@@ -205,6 +282,7 @@ static int get8859Code(uint8_t code) {
         if (!is_extended) {
             // Regular keys (not extended)
             uint8_t shift_pressed = modifier_flags & (SHIFT_L_BIT | SHIFT_R_BIT);
+            uint8_t num_lock = modifier_flags & NUM_BIT;
 
             // Numpad keys: num_lock controls which map to use, shift inverts
             if (code >= 0x69 && code <= 0x7D) {
@@ -216,7 +294,7 @@ static int get8859Code(uint8_t code) {
             } else {
                 // Regular keys: check if we need to invert due to caps lock
                 uint8_t use_shifted = shift_pressed;
-                if (caps_lock) {
+                if (modifier_flags & CAPS_BIT) {
                     // Check if either map has a letter for this scancode
                     uint8_t normal_char = EN_US.normal[code];
                     uint8_t shifted_char = EN_US.shifted[code];
@@ -259,15 +337,23 @@ static int get8859Code(uint8_t code) {
         // Clear flags now that we've handled the key
         modifier_flags &= ~(BREAK | EXTEND);
 
+        // Macro keys are typed by the main loop, not sent as key events
+        if (c && checkMacro((uint8_t)c, is_release)) {
+            return -1;
+        }
+
         // Return character with release bit set if needed
         if (c) {
             if (is_release) {
                 // Only special keys (bit 7 set) send release events
                 if (c & 0x80) {
-                    return c | 0x40;  // Set bit 6 for release
+                    return releaseKey((uint8_t)c);  // Sets bit 6 for release
                 }
                 return -1;  // Ignore release for regular keys
             }
+            if (c & 0x80) {
+                return pressKey((uint8_t)c);
+            }
             return c;  // Press event
         }
         return -1;
@@ -277,17 +363,21 @@ static int get8859Code(uint8_t code) {
 
 static uint8_t UTF8buffer = 0;
 
+static int encodeUTF8(int result) {
+    if (result >= 128) {
+        UTF8buffer = (result & 0x3F) | 0x80;
+        result = (result >> 6) | 0xC0;
+    }
+    return result;
+}
+
 int getkbdchar(uint8_t code) {
     int result;
     result = UTF8buffer;
     if (result) {
         UTF8buffer = 0;
     } else {
-        result = get8859Code(code);
-        if (result >= 128) {
-            UTF8buffer = (result & 0x3F) | 0x80;
-            result = (result >> 6) | 0xC0;
-        }
+        result = encodeUTF8(get8859Code(code));
     }
     if (!result) return -1;
     return result;
@@ -303,3 +393,63 @@ int getkbdcharn(uint8_t code) {
 int hasUTF8Buffered(void) {
     return UTF8buffer != 0;
 }
+
+// Releases and modifier/lock presses change host state and must not be lost
+int isPriorityKey(uint8_t lead) {
+    if (lead == 0xC3) return 1;  // Release (bit 6 set)
+    if (lead == 0xC2) return isModifier(0x80 | (UTF8buffer & 0x3F));
+    return 0;
+}
+
+// Record a special key event in key_state once it has been buffered, so a
+// dropped event leaves the bitmap matching what the host has seen.
+// Call before the UTF-8 continuation byte is taken.
+void commitKeyEvent(uint8_t lead) {
+    if (lead != 0xC2 && lead != 0xC3) return;
+    uint8_t c = (uint8_t)(lead << 6) | (UTF8buffer & 0x3F);
+    uint8_t idx = (c & ~0x40) - F1;
+    uint8_t mask = (uint8_t)(1 << (idx & 7));
+    if (c & 0x40) {
+        key_state[idx >> 3] &= ~mask;
+    } else {
+        key_state[idx >> 3] |= mask;
+    }
+}
+
+// Safe to call outside the ISR: only sets a flag, getkbdrelease() does the work
+#pragma warning push
+#pragma warning disable 1510
+void releaseAllKeys(void) {
+    modifier_flags |= RELEASE_ALL;
+}
+
+int hasReleasePending(void) {
+    return (modifier_flags & RELEASE_ALL) != 0;
+}
+#pragma warning pop
+
+// Release a Ctrl key the host still sees held, so macro text isn't read as
+// Ctrl combinations. Returns -1 once neither is down.
+int getkbdctrlrelease(void) {
+    if (isKeyDown(CTRL_L)) return encodeUTF8(releaseKey(CTRL_L));
+    if (isKeyDown(CTRL_R)) return encodeUTF8(releaseKey(CTRL_R));
+    return -1;
+}
+
+int getkbdrelease(void) {
+    modifier_flags &= ~(SHIFT_L_BIT | SHIFT_R_BIT);
+    for (uint8_t i = 0; i < KEY_STATE_SIZE; i++) {
+        uint8_t bits = key_state[i];
+        if (bits) {
+            uint8_t c = F1 + (uint8_t)(i << 3);
+            while (!(bits & 1)) {
+                bits >>= 1;
+                c++;
+            }
+            return encodeUTF8(releaseKey(c));
+        }
+    }
+    modifier_flags &= ~RELEASE_ALL;
+    macro_key = 0;
+    return -1;
+}
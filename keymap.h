@@ -82,6 +82,9 @@
 #define SCROL   0xA1
 #define PAUSE   0xA2
 
+// Mouse report marker, followed by buttons, dx, dy
+#define MOUSE   0xA3
+
 typedef struct {
     unsigned char normal[KEYMAP_SIZE];
     unsigned char shifted[KEYMAP_SIZE];
@@ -89,8 +92,17 @@ typedef struct {
 
 extern const Keymap EN_US;
 
+void initKeyboard(void);
 int getkbdchar(uint8_t code);
 int getkbdcharn(uint8_t code);
 int hasUTF8Buffered(void);
+int isPriorityKey(uint8_t lead);
+void commitKeyEvent(uint8_t lead);
+
+// Synthetic releases for keys still held after a reset, overrun or lost event
+void releaseAllKeys(void);
+int hasReleasePending(void);
+int getkbdrelease(void);
+int getkbdctrlrelease(void);
 
 #endif
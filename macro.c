@@ -0,0 +1,65 @@
+#include <pic.h>
+#include <xc.h>
+#include "macro.h"
+
+#define MACRO_COUNT 12
+
+// Macro strings, ASCII only. Unused slots are 0 and pass the F-key through.
+static const char macro_f1[] = "LIST\r";
+static const char macro_f2[] = "RUN\r";
+static const char macro_f3[] = "LOAD \"";
+static const char macro_f4[] = "SAVE \"";
+static const char macro_f5[] = "PRINT ";
+static const char macro_f6[] = "GOTO ";
+static const char macro_f9[] = "0000.00FF\r";
+
+static const char * const macros[MACRO_COUNT] = {
+    macro_f1, macro_f2, macro_f3, macro_f4, macro_f5, macro_f6,
+    0, 0, macro_f9, 0, 0, 0
+};
+
+// Triggered macro waiting to start (index + 1, 0 = none)
+static volatile uint8_t macro_pending = 0;
+
+// Next byte of the macro being typed (0 = idle)
+static const char *macro_cursor = 0;
+
+uint8_t macro_start(uint8_t index) {
+    if (index >= MACRO_COUNT || !macros[index]) return 0;
+    if (macro_pending) return 0;  // Don't replace one that hasn't started
+    macro_pending = index + 1;
+    return 1;
+}
+
+int macro_nextByte(void) {
+    if (!macro_cursor) {
+        // A trigger from the ISR between the read and the clear would be lost
+        INTCONbits.GIE = 0;
+        uint8_t pending = macro_pending;
+        macro_pending = 0;
+        INTCONbits.GIE = 1;
+        if (!pending) return -1;
+        macro_cursor = macros[pending - 1];
+    }
+
+    char c = *macro_cursor++;
+    if (!*macro_cursor) {
+        macro_cursor = 0;
+    }
+    return (uint8_t)c;
+}
+
+#pragma warning push
+#pragma warning disable 1510
+uint8_t macro_isPending(void) {
+    return macro_pending != 0;
+}
+#pragma warning pop
+
+uint8_t macro_isTyping(void) {
+    return macro_cursor != 0;
+}
+
+uint8_t macro_isIdle(void) {
+    return !macro_cursor && !macro_pending;
+}
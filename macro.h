@@ -0,0 +1,16 @@
+#ifndef MACRO_H
+#define MACRO_H
+
+#include <stdint.h>
+
+// Ctrl+F1..F12 type strings stored in program memory. Triggering a macro only
+// queues a cursor; the main loop streams bytes once the keystrokes buffered
+// before the trigger have been sent.
+
+uint8_t macro_start(uint8_t index);        // Called from the ISR, returns 1 if started
+int macro_nextByte(void);                  // Called from the main loop, -1 when idle
+uint8_t macro_isPending(void);             // Triggered, waiting to start
+uint8_t macro_isTyping(void);              // Started, bytes left to send
+uint8_t macro_isIdle(void);                // No macro typing or waiting to start
+
+#endif
@@ -23,55 +23,227 @@
 #define KBD_DATA       PORTBbits.RB4
 #define SR_CLK         PORTBbits.RB6
 #define SR_DATA        PORTBbits.RB5
-#define INTB           PORTBbits.RB7
 #define KBD_CLOCK_DIR  TRISBbits.TRISB0
 #define KBD_DATA_DIR   TRISBbits.TRISB4
 #define SR_CLK_DIR     TRISBbits.TRISB6
 #define SR_DATA_DIR    TRISBbits.TRISB5
-#define INTB_DIR       TRISBbits.TRISB7
 #define DEBUG_LED      PORTAbits.RA2
 #define DEBUG_LED_DIR  TRISAbits.TRISA2
 
+#ifdef PS2_MOUSE
+// Mouse clock needs interrupt-on-change, which only RB4-RB7 have. Every PORTB
+// read ends the mismatch and can swallow a change landing during the read,
+// so INTB, polled by the idle loop, moves to PORTA.
+// Masks apply to a PORTB snapshot (must match ps2_send.c).
+#define INTB           PORTAbits.RA0
+#define INTB_DIR       TRISAbits.TRISA0
+#define MOUSE_CLOCK_MASK 0x80  // RB7
+#define MOUSE_DATA_MASK  0x04  // RB2
+#else
+#define INTB           PORTBbits.RB7
+#define INTB_DIR       TRISBbits.TRISB7
+#endif
+
 #include <xc.h>
 #include "keymap.h"
 #include "ps2_send.h"
+#include "mouse.h"
+#include "macro.h"
 
-// Keystroke circular buffer - 16 bytes
+// Event timestamps: 0 = off, 1 = arrival tick, 2 = arrival and dequeue ticks
+#ifndef TIMESTAMPS
+#define TIMESTAMPS 0
+#endif
+#if TIMESTAMPS > 2
+#error "TIMESTAMPS must be 0, 1 or 2"
+#endif
+
+// Keystroke circular buffer. Larger sizes can be configured, the link fails
+// if they don't fit in RAM (check_ram.cmake).
+// The last BUFFER_RESERVE bytes are kept free for priority events
+#ifndef BUFFER_SIZE
 #define BUFFER_SIZE 16
-#define BUFFER_MASK 0x0F
+#endif
+#define BUFFER_MASK (BUFFER_SIZE - 1)
+#if BUFFER_SIZE & BUFFER_MASK
+#error "BUFFER_SIZE must be a power of two"
+#endif
+#define BUFFER_RESERVE 4
 volatile uint8_t keyBuffer[BUFFER_SIZE];
 volatile uint8_t bufferHead = 0;
 volatile uint8_t bufferTail = 0;
 
-// Store received data in circular buffer
-void decodeScancode(uint8_t data) {
+// bufferHead when the pending macro was triggered. Keys buffered before it go
+// out first, keys after it wait until the macro has been typed.
+static volatile uint8_t macroMark = 0;
+
+#if TIMESTAMPS
+// Timer1 at 1:8 prescale, high byte extended by an overflow count in the ISR
+// gives a 16-bit tick of 409.6us that wraps every ~26.8s
+#define STAMP_SIZE (TIMESTAMPS * 2)
+volatile uint16_t keyTime[BUFFER_SIZE];  // Arrival tick of each buffered byte
+static volatile uint8_t tmr1_overflows = 0;
+static uint8_t stamp[STAMP_SIZE];        // Timestamp bytes being sent
+static uint8_t stampIndex = STAMP_SIZE;
+
+// Call with interrupts disabled outside the ISR
+#pragma warning push
+#pragma warning disable 1510
+static uint16_t timestamp(void) {
+    uint8_t hi = tmr1_overflows;
+    uint8_t lo = TMR1H;
+    if (PIR1bits.TMR1IF && lo < 0x80) hi++;  // Overflow not counted yet
+    return ((uint16_t)hi << 8) | lo;
+}
+#pragma warning pop
+
+// Queue the timestamp that follows a completed event
+static void startStamp(uint16_t arrival) {
+    stamp[0] = (uint8_t)(arrival >> 8);
+    stamp[1] = (uint8_t)arrival;
+#if TIMESTAMPS > 1
+    INTCONbits.GIE = 0;
+    uint16_t now = timestamp();
+    INTCONbits.GIE = 1;
+    stamp[2] = (uint8_t)(now >> 8);
+    stamp[3] = (uint8_t)now;
+#endif
+    stampIndex = 0;
+}
+#endif
+
+// Buffer a translated key and its UTF-8 continuation byte, if any
+// Printable keys may not use the reserve; priority keys may also evict them
+// If there is no room the whole key is dropped
+static void bufferKey(int c) {
+    uint8_t size = hasUTF8Buffered() ? 2 : 1;
+    uint8_t space = (bufferTail - bufferHead - 1) & BUFFER_MASK;
+    uint8_t priority = (uint8_t)isPriorityKey((uint8_t)c);
+
+    if (priority) {
+        // Evict the newest printable keys, but never the one at the tail
+        // since main() may be reading it
+        while (space < size) {
+            uint8_t last = (bufferHead - 1) & BUFFER_MASK;
+            if (last == bufferTail || keyBuffer[last] >= 0x80) break;
+            if (macroMark == bufferHead) macroMark = last;
+            bufferHead = last;
+            space++;
+        }
+    } else {
+        size += BUFFER_RESERVE;
+    }
+
+    if (space < size) {
+        if (hasUTF8Buffered()) getkbdchar(0);  // Discard continuation byte
+        if (priority) {
+            // Dropped a state change even after evicting printable keys -
+            // resync the host's key state. A dropped release left its key
+            // marked down, so it is among the releases sent.
+            releaseAllKeys();
+        }
+        return;
+    }
+
+    commitKeyEvent((uint8_t)c);  // Host will see it - update key state
+#if TIMESTAMPS
+    uint16_t now = timestamp();
+    keyTime[bufferHead] = now;
+#endif
+    keyBuffer[bufferHead] = (uint8_t)c;
+    bufferHead = (bufferHead + 1) & BUFFER_MASK;
+    if (hasUTF8Buffered()) {
+#if TIMESTAMPS
+        keyTime[bufferHead] = now;
+#endif
+        keyBuffer[bufferHead] = (uint8_t)getkbdchar(0);
+        bufferHead = (bufferHead + 1) & BUFFER_MASK;
+    }
+}
+
+// Scancodes that arrive while synthetic releases are still being queued wait
+// here, so the host sees every release before any later key event
+#define HELD_SIZE 4
+#define HELD_MASK (HELD_SIZE - 1)
+static uint8_t heldCodes[HELD_SIZE];
+static volatile uint8_t heldHead = 0;
+static volatile uint8_t heldTail = 0;
+
+// Translate a scancode and buffer the resulting key event
+static void translateScancode(uint8_t data) {
+    uint8_t pending = macro_isPending();
     int c = getkbdchar(data);
-    if (c == -1) return;
-
-    // Buffer first byte
-    uint8_t nextHead = (bufferHead + 1) & BUFFER_MASK;
-    if (nextHead != bufferTail) {
-        keyBuffer[bufferHead] = (uint8_t)c;
-        bufferHead = nextHead;
-
-        // Check if there's a second byte buffered
-        if (hasUTF8Buffered()) {
-            c = getkbdchar(0);  // Get buffered byte
-            if (c != -1) {
-                nextHead = (bufferHead + 1) & BUFFER_MASK;
-                if (nextHead != bufferTail) {
-                    keyBuffer[bufferHead] = (uint8_t)c;
-                    bufferHead = nextHead;
-                }
-            }
+    if (c != -1) bufferKey(c);
+    if (!pending && macro_isPending()) {
+        // Macro triggered: release Ctrl first, then type it after the keys
+        // buffered so far. At most two, one per Ctrl key.
+        for (uint8_t i = 0; i < 2; i++) {
+            c = getkbdctrlrelease();
+            if (c == -1) break;
+            bufferKey(c);
         }
+        macroMark = bufferHead;
+    }
+}
+
+// Do one step of deferred work: queue one synthetic release for a key the
+// host still thinks is held, or once they are all queued, translate one held
+// scancode. One step per call keeps the ISR short enough not to miss mouse
+// clock edges; the rest follow on later frames and Timer0 ticks.
+static void flushPending(void) {
+    if (hasReleasePending()) {
+        if (((bufferTail - bufferHead - 1) & BUFFER_MASK) < 2) return;
+        int c = getkbdrelease();
+        if (c != -1) bufferKey(c);
+    } else if (heldHead != heldTail) {
+        uint8_t data = heldCodes[heldTail];
+        heldTail = (heldTail + 1) & HELD_MASK;
+        translateScancode(data);
     }
 }
 
+// Store received data in circular buffer
+void decodeScancode(uint8_t data) {
+    if (!hasReleasePending() && heldHead == heldTail) {
+        translateScancode(data);
+        return;
+    }
+
+    // Wait behind the pending releases
+    uint8_t next = (heldHead + 1) & HELD_MASK;
+    if (next == heldTail) {
+        releaseAllKeys();  // Lost a scancode, like a keyboard overrun
+    } else {
+        heldCodes[heldHead] = data;
+        heldHead = next;
+    }
+    flushPending();
+}
+
+// PS/2 receive state, shared with idleSleep()
+static volatile uint8_t ps2_state = 0; // bits 0-3: count, bit 4: parity
+#ifdef IDLE_SLEEP
+// Crystal start-up after SLEEP hasn't been measured, so clock edges after
+// the one that woke us may be missed. If the frame it started fails, ask the
+// keyboard to send it again.
+#define WAKE_EDGE  0x01  // Next clock edge woke us, take it as the start bit
+#define WAKE_FRAME 0x02  // Frame in progress started on waking
+static volatile uint8_t ps2_wake = 0;
+
+static void wakeFrameFailed(void) {
+    if (ps2_wake & WAKE_FRAME) ps2_flags |= PS2_RESEND;
+    ps2_wake = 0;
+}
+#endif
+
 void __interrupt() isr(void) {
     // PS/2 state machine
     static uint8_t ps2_data = 0;
-    static uint8_t ps2_state = 0; // bits 0-3: count, bit 4: parity
+    static uint16_t echo_counter = 0;  // Timer0 overflows since last frame
+#ifdef PS2_MOUSE
+    static uint8_t mouse_data = 0;
+    static uint8_t mouse_state = 0x80; // as ps2_state, bit 7: last clock level
+#endif
 
     // Handle PS/2 clock interrupt (only process if INTE enabled)
     if (INTCONbits.INTF && INTCONbits.INTE) {
@@ -84,6 +256,11 @@ void __interrupt() isr(void) {
 
         switch(count) {
             case 0:               // Start bit - must be 0
+#ifdef IDLE_SLEEP
+                // Oscillator start-up delays us past the start bit, but the
+                // edge that woke us can only be one
+                if (ps2_wake & WAKE_EDGE) bit = 0;
+#endif
                 if (!bit) {
                     ps2_state = 1;
                     ps2_data = 0; // Clear data for new packet
@@ -95,11 +272,31 @@ void __interrupt() isr(void) {
                     ps2_state = (ps2_state & 0xF0) | 10;
                 } else {         // Parity error, reset
                     ps2_state = 0;
+#ifdef IDLE_SLEEP
+                    wakeFrameFailed();
+#endif
                 }
                 break;
             case 10:             // Stop bit - must be 1
                 DEBUG_LED = 1;
-                if (bit) decodeScancode(ps2_data);
+                if (bit) {
+                    // Keyboard is alive - no echo needed
+                    echo_counter = 0;
+                    ps2_flags &= ~PS2_ECHO_TIMEOUT;
+                    ps2_flags |= PS2_KBD_ALIVE;
+#ifdef IDLE_SLEEP
+                    if (ps2_flags & PS2_RESEND) {
+                        // Too late to ask for the failed frame again
+                        ps2_flags &= ~PS2_RESEND;
+                        releaseAllKeys();
+                    }
+                    ps2_wake = 0;
+#endif
+                    decodeScancode(ps2_data);
+                }
+#ifdef IDLE_SLEEP
+                else wakeFrameFailed();
+#endif
                 ps2_state = 0;
                 break;
             default:             // count 1-8: data bits
@@ -111,26 +308,98 @@ void __interrupt() isr(void) {
                 ps2_state = (ps2_state & 0xF0) | ((count + 1) & 0x0F);
                 break;
         }
+#ifdef IDLE_SLEEP
+        ps2_wake &= ~WAKE_EDGE;
+#endif
+    }
+
+#ifdef PS2_MOUSE
+    // Handle mouse clock interrupt-on-change (only falling edges clock data)
+    if (INTCONbits.RBIF && INTCONbits.RBIE) {
+        uint8_t port = PORTB;     // Reading PORTB ends the mismatch
+        INTCONbits.RBIF = 0;
+
+        if (!(port & MOUSE_CLOCK_MASK) && (mouse_state & 0x80)) {
+            TMR0 = 22;            // Preload for ~3ms timeout
+            INTCONbits.TMR0IF = 0;
+
+            uint8_t bit = (port & MOUSE_DATA_MASK) ? 1 : 0;
+            uint8_t count = mouse_state & 0x0F;
+
+            switch(count) {
+                case 0:           // Start bit - must be 0
+                    if (!bit) {
+                        mouse_state = 1;
+                        mouse_data = 0;
+                    }
+                    break;
+                case 9:           // Parity bit
+                    if ((((mouse_state >> 4)) & 1) != bit) {
+                        mouse_state = (mouse_state & 0xF0) | 10;
+                    } else {
+                        mouse_state = 0;
+                    }
+                    break;
+                case 10:          // Stop bit - must be 1
+                    if (bit) mouse_receiveByte(mouse_data);
+                    mouse_state = 0;
+                    break;
+                default:          // count 1-8: data bits
+                    mouse_data >>= 1;
+                    if (bit) {
+                        mouse_data |= 0x80;
+                        mouse_state ^= 0x10;
+                    }
+                    mouse_state = (mouse_state & 0xF0) | ((count + 1) & 0x0F);
+                    break;
+            }
+        }
+
+        // Remember the clock level for edge detection
+        if (port & MOUSE_CLOCK_MASK) {
+            mouse_state |= 0x80;
+        } else {
+            mouse_state &= 0x7F;
+        }
     }
+#endif
+
+#if TIMESTAMPS
+    // Extend Timer1 for timestamps
+    if (PIR1bits.TMR1IF) {
+        PIR1bits.TMR1IF = 0;
+        tmr1_overflows++;
+    }
+#endif
 
     // Handle Timer0 timeout - reset PS/2 packet state if no clock for 3ms
     if (INTCONbits.TMR0IF) {
-        static uint16_t echo_counter = 0;
-
+#ifdef IDLE_SLEEP
+        if (ps2_state) wakeFrameFailed();  // Missed clock edges
+#endif
         ps2_state = 0;
         ps2_data = 0;
+#ifdef PS2_MOUSE
+        mouse_state &= 0x80;
+        mouse_data = 0;
+        mouse_resync();
+#endif
         DEBUG_LED = 0;
 
         // If in transmission mode, signal timeout
         if (!INTCONbits.INTE) {
-            tx_timeout = 1;
+            ps2_flags |= PS2_TX_TIMEOUT;
         }
 
-        // Timer0 fires every ~3ms, count to 3333 for ~10 seconds
+        // Drain synthetic releases and held scancodes as the host frees space
+        flushPending();
+
+        // Timer0 fires every ~3ms while the keyboard is silent, so an echo is
+        // only sent after ~10 seconds without a received frame
         echo_counter++;
         if (echo_counter >= 3333) {
             echo_counter = 0;
-            echo_timeout = 1;
+            ps2_flags |= PS2_ECHO_TIMEOUT;
         }
 
         INTCONbits.TMR0IF = 0;
@@ -138,6 +407,49 @@ void __interrupt() isr(void) {
     }
 }
 
+// Pick the next byte for the host: keystrokes first, interleaved with mouse
+// reports between whole key events, then macro expansion when both are idle.
+// Once the keys typed before a macro trigger are out, the macro is typed to
+// the end before any later keystrokes.
+// With TIMESTAMPS, each key event and macro byte is followed by its stamp.
+static int nextOutputByte(void) {
+    int data;
+#if TIMESTAMPS
+    if (stampIndex < STAMP_SIZE) return stamp[stampIndex++];
+#endif
+#ifdef PS2_MOUSE
+    data = mouse_nextByte();   // Finish a report in progress
+    if (data != -1) return data;
+#endif
+    uint8_t macro_first = macro_isTyping() ||
+                          (macro_isPending() && bufferTail == macroMark);
+    if (bufferHead != bufferTail && !macro_first) {
+        data = keyBuffer[bufferTail];
+#if TIMESTAMPS
+        if (data < 0xC0) startStamp(keyTime[bufferTail]);  // Event complete
+#endif
+        bufferTail = (bufferTail + 1) & BUFFER_MASK;
+#ifdef PS2_MOUSE
+        if (data < 0xC0) mouse_startReport();  // Not a UTF-8 lead byte
+#endif
+        return data;
+    }
+#ifdef PS2_MOUSE
+    if (mouse_startReport()) return mouse_nextByte();
+#endif
+    data = macro_nextByte();
+#if TIMESTAMPS
+    if (data != -1) {
+        // Macro bytes arrive when they are sent
+        INTCONbits.GIE = 0;
+        uint16_t now = timestamp();
+        INTCONbits.GIE = 1;
+        startStamp(now);
+    }
+#endif
+    return data;
+}
+
 void setup(void) {
     TRISA = 0xFF;
     TRISB = 0xFF;       // all ports are input
@@ -168,39 +480,164 @@ void setup(void) {
     INTCONbits.INTF = 0;        // Clear interrupt flag
     INTCONbits.INTE = 1;        // Enable external interrupt
 
+#if TIMESTAMPS
+    // Free-running Timer1 for event timestamps, 1.6us per tick at 20MHz
+    T1CONbits.TMR1CS = 0;       // Internal clock
+    T1CONbits.T1CKPS = 0b11;    // Prescaler 1:8
+    T1CONbits.TMR1ON = 1;
+    PIR1bits.TMR1IF = 0;
+    PIE1bits.TMR1IE = 1;        // Count overflows
+    INTCONbits.PEIE = 1;        // Enable peripheral interrupts
+#endif
+
+    // Configure the keyboard now rather than waiting for BAT (0xAA), which
+    // was missed if the keyboard finished its self-test before we started.
+    // If it's still testing, the commands time out and BAT re-runs this.
+    initKeyboard();
+
+#ifdef PS2_MOUSE
+    // Enable interrupt-on-change on RB7 (MOUSE_CLOCK)
+    (void)PORTB;                // End any mismatch condition
+    INTCONbits.RBIF = 0;
+    INTCONbits.RBIE = 1;
+#endif
+
     INTCONbits.GIE = 1;         // Enable the interrupt vector
 }
 
+// Shift register timing in 25us units: setup, hold and recovery per bit
+#define SR_UNIT_US     25
+#define SR_SETUP       4      // 100us
+#define SR_HOLD        140    // 3500us
+#define SR_RECOVERY    4      // 100us
+
+#ifdef SR_AUTOTUNE
+// Each level halves the bit timing. Start at level 0 and step up after
+// SR_CLEAN_BYTES bytes with INTB high up to their last clock edge, up to
+// SR_AUTOTUNE_FLOOR. INTB asserted before that edge steps back down and
+// caps the level there until the keyboard is reset.
+#ifndef SR_AUTOTUNE_FLOOR
+#define SR_AUTOTUNE_FLOOR 4   // 200us hold, ~2ms per byte
+#endif
+#if SR_AUTOTUNE_FLOOR > 7
+#error "SR_AUTOTUNE_FLOOR must be 7 or less"
+#endif
+#define SR_CLEAN_BYTES 16
+
+static uint8_t sr_level = 0;
+static uint8_t sr_ceiling = SR_AUTOTUNE_FLOOR;
+static uint8_t sr_clean = 0;
+
+static void delayUnits(uint8_t units) {
+    while (units--) __delay_us(SR_UNIT_US);
+}
+
+static uint8_t scaleUnits(uint8_t units) {
+    units >>= sr_level;
+    return units ? units : 1;
+}
+#endif
+
 void shiftOutByte(uint8_t data) {
     // Target ~29ms latency (~34 cps)
     // Faster shifts are usually possible but also usually not needed
+#ifdef SR_AUTOTUNE
+    uint8_t setup = scaleUnits(SR_SETUP);
+    uint8_t hold = scaleUnits(SR_HOLD);
+    uint8_t recovery = scaleUnits(SR_RECOVERY);
+    uint8_t stalled = 0;
+#endif
     for (uint8_t i = 0; i < 8; i++) {
         SR_DATA = (data >> (7 - i)) & 1; // Set data bit
-        __delay_us(100);                 // Setup time
+#ifdef SR_AUTOTUNE
+        delayUnits(setup);               // Setup time
+        // Only INTB before the last clock edge is a stall - a host using
+        // its shift-complete IRQ as INTB asserts it right after
+        if (!INTB) stalled = 1;
         SR_CLK = 1;
-        __delay_us(3500);                // Hold time
+        delayUnits(hold);                // Hold time
         SR_CLK = 0;
-        __delay_us(100);                 // Recovery time
+        delayUnits(recovery);            // Recovery time
+#else
+        __delay_us(SR_SETUP * SR_UNIT_US);     // Setup time
+        SR_CLK = 1;
+        __delay_us(SR_HOLD * SR_UNIT_US);      // Hold time
+        SR_CLK = 0;
+        __delay_us(SR_RECOVERY * SR_UNIT_US);  // Recovery time
+#endif
     }
     SR_DATA = 0;  // Reset data line to low
+
+#ifdef SR_AUTOTUNE
+    if (stalled) {
+        // Host asserted INTB mid-byte: back off and stay there
+        if (sr_level) sr_level--;
+        sr_ceiling = sr_level;
+        sr_clean = 0;
+    } else if (sr_level < sr_ceiling && ++sr_clean >= SR_CLEAN_BYTES) {
+        sr_level++;
+        sr_clean = 0;
+    }
+#endif
 }
 
+#ifdef IDLE_SLEEP
+#ifdef PS2_MOUSE
+#error "IDLE_SLEEP is not supported with PS2_MOUSE"
+#endif
+// SLEEP until the next keyboard clock edge when there is nothing to do.
+// Timer0 stops in SLEEP, so only sleep between frames.
+static void idleSleep(void) {
+    INTCONbits.GIE = 0;
+    if (bufferHead == bufferTail && ps2_state == 0 &&
+        !hasReleasePending() && heldHead == heldTail &&
+        !ps2_commandsPending() && macro_isIdle()
+#if TIMESTAMPS
+        && stampIndex >= STAMP_SIZE
+#endif
+    ) {
+        // An edge since GIE was cleared sets INTF and SLEEP returns at once
+        ps2_wake = WAKE_EDGE | WAKE_FRAME;
+        SLEEP();
+        NOP();
+        DEBUG_LED = 1;        // Wake latency: KBD_CLOCK fall to DEBUG_LED rise
+        if (!INTCONbits.INTF) ps2_wake = 0;
+    }
+    INTCONbits.GIE = 1;
+}
+#endif
+
 int main() {
     setup();
 
     while (1) {
         // Process command queue
         ps2_processCommands();
+#ifdef PS2_MOUSE
+        mouse_processCommands();
+#endif
+
+#ifdef SR_AUTOTUNE
+        // Keyboard was reset - start tuning again from the safe timing
+        if (ps2_flags & PS2_KBD_RESET) {
+            ps2_flags &= ~PS2_KBD_RESET;
+            sr_level = 0;
+            sr_ceiling = SR_AUTOTUNE_FLOOR;
+            sr_clean = 0;
+        }
+#endif
 
-        // Process keystroke buffer if data available
-        if (bufferHead != bufferTail) {
-            // Check if MCU is ready to receive (INTB high)
-            if (INTB) {
-                uint8_t data = keyBuffer[bufferTail];
-                bufferTail = (bufferTail + 1) & BUFFER_MASK;
-                shiftOutByte(data);
+        // Check if MCU is ready to receive (INTB high)
+        if (INTB) {
+            int data = nextOutputByte();
+            if (data != -1) {
+                shiftOutByte((uint8_t)data);
+                continue;
             }
         }
+#ifdef IDLE_SLEEP
+        idleSleep();
+#endif
     }
     return 0;
 }
@@ -0,0 +1,169 @@
+#include <pic.h>
+#include <xc.h>
+#include "mouse.h"
+#include "keymap.h"
+#include "ps2_send.h"
+
+#ifdef PS2_MOUSE
+
+// Command IDs
+#define CMD_ENABLE  0xF4
+#define CMD_RESET   0xFF
+
+// Packet byte 0 flags
+#define PKT_BUTTONS 0x07
+#define PKT_SYNC    0x08  // Always set in byte 0
+#define PKT_X_SIGN  0x10
+#define PKT_Y_SIGN  0x20
+#define PKT_X_OVF   0x40
+#define PKT_Y_OVF   0x80
+
+// Report: 2-byte marker, buttons, dx, dy
+#define REPORT_SIZE 5
+
+// State flags (mouse_flags bits). Outside the ISR, only change them with
+// single-bit or single-instruction updates.
+#define STREAMING    0x01  // Data reporting enabled
+#define PENDING      0x02  // Motion or buttons not yet reported
+#define RETRY_MASK   0x0C  // Failed command attempts
+#define RETRY_ONE    0x04
+static volatile uint8_t mouse_flags = 0;
+
+// Packet assembly (ISR only)
+static uint8_t packet[2];
+static uint8_t packet_index = 0;
+
+// Pending command, sent from the main loop. Reset on power-up in case the
+// mouse finished its BAT before we were listening.
+static volatile uint8_t mouse_cmd = CMD_RESET;
+
+// Motion accumulated since the last report. Button presses are latched until
+// reported so a click between reports isn't lost.
+static volatile int8_t mouse_dx = 0;
+static volatile int8_t mouse_dy = 0;
+static volatile uint8_t mouse_buttons = 0;
+static volatile uint8_t mouse_held = 0;
+
+// Report being shifted out (buttons, dx, dy)
+static uint8_t report[3];
+static uint8_t report_index = REPORT_SIZE;
+
+static int8_t addSaturate(int8_t acc, int16_t delta) {
+    int16_t sum = acc + delta;
+    if (sum > 127) return 127;
+    if (sum < -128) return -128;
+    return (int8_t)sum;
+}
+
+void mouse_receiveByte(uint8_t data) {
+    if (!(mouse_flags & STREAMING)) {
+        // BAT complete - enable stream mode reporting
+        if (data == 0xAA) {
+            mouse_cmd = CMD_ENABLE;
+            mouse_flags &= ~RETRY_MASK;
+        }
+        return;
+    }
+
+    if (packet_index == 0) {
+        // Wait for a valid first byte to resync
+        if (data & PKT_SYNC) {
+            packet[0] = data;
+            packet_index = 1;
+        }
+        return;
+    }
+
+    if (packet_index == 1) {
+        // A hot-plugged mouse sends BAT (0xAA) and ID (0x00)
+        if (packet[0] == 0xAA && data == 0x00) {
+            packet_index = 0;
+            mouse_flags &= ~(STREAMING | RETRY_MASK);
+            mouse_cmd = CMD_ENABLE;
+            return;
+        }
+        packet[1] = data;
+        packet_index = 2;
+        return;
+    }
+
+    packet_index = 0;
+
+    // 9-bit two's complement deltas, overflow saturates
+    int16_t dx = packet[1];
+    int16_t dy = data;
+    if (packet[0] & PKT_X_SIGN) dx -= 256;
+    if (packet[0] & PKT_Y_SIGN) dy -= 256;
+    if (packet[0] & PKT_X_OVF) dx = (packet[0] & PKT_X_SIGN) ? -256 : 255;
+    if (packet[0] & PKT_Y_OVF) dy = (packet[0] & PKT_Y_SIGN) ? -256 : 255;
+
+    mouse_dx = addSaturate(mouse_dx, dx);
+    mouse_dy = addSaturate(mouse_dy, dy);
+    mouse_held = packet[0] & PKT_BUTTONS;
+    mouse_buttons |= mouse_held;
+    mouse_flags |= PENDING;
+}
+
+#pragma warning push
+#pragma warning disable 1510
+void mouse_resync(void) {
+    packet_index = 0;
+}
+#pragma warning pop
+
+void mouse_processCommands(void) {
+    uint8_t cmd = mouse_cmd;
+    if (!cmd) return;
+
+    if (cmd == CMD_RESET) {
+        mouse_flags &= ~STREAMING;
+    }
+    uint8_t response = ps2_sendMouseByte(cmd);
+
+    if (response == 0xFA) {
+        // After a reset, wait for BAT before enabling
+        if (cmd == CMD_ENABLE) {
+            mouse_flags |= STREAMING;
+        }
+        mouse_cmd = 0;
+        mouse_flags &= ~RETRY_MASK;
+    } else if ((mouse_flags & RETRY_MASK) == 2 * RETRY_ONE) {
+        // Third failure, no mouse attached - wait for a hot-plug BAT
+        mouse_cmd = 0;
+        mouse_flags &= ~RETRY_MASK;
+    } else {
+        mouse_flags += RETRY_ONE;
+    }
+}
+
+uint8_t mouse_startReport(void) {
+    if (!(mouse_flags & PENDING) || report_index < REPORT_SIZE) return 0;
+
+    INTCONbits.RBIE = 0;
+    report[0] = mouse_buttons;
+    report[1] = (uint8_t)mouse_dx;
+    report[2] = (uint8_t)mouse_dy;
+    mouse_dx = 0;
+    mouse_dy = 0;
+    mouse_buttons = mouse_held;
+    // Leave a latched click pending so its release is reported too
+    if (mouse_buttons == report[0]) {
+        mouse_flags &= ~PENDING;
+    }
+    INTCONbits.RBIE = 1;
+
+    report_index = 0;
+    return 1;
+}
+
+int mouse_nextByte(void) {
+    uint8_t i = report_index;
+    if (i >= REPORT_SIZE) return -1;
+    report_index++;
+
+    if (i == 0) return (MOUSE >> 6) | 0xC0;    // UTF-8 lead byte
+    if (i == 1) return (MOUSE & 0x3F) | 0x80;  // UTF-8 continuation byte
+    return report[i - 2];
+}
+
+#endif
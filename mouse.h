@@ -0,0 +1,18 @@
+#ifndef MOUSE_H
+#define MOUSE_H
+
+#include <stdint.h>
+
+// PS/2 mouse on the second channel (only built with PS2_MOUSE defined)
+// Host report: UTF-8 encoded MOUSE marker, then buttons, dx, dy as raw bytes
+
+// Called from the ISR
+void mouse_receiveByte(uint8_t data);      // Assemble packets, accumulate motion
+void mouse_resync(void);                   // Drop a partial packet
+
+// Called from the main loop
+void mouse_processCommands(void);          // Send pending reset/enable command
+uint8_t mouse_startReport(void);           // Snapshot pending motion, returns 1 if started
+int mouse_nextByte(void);                  // Next report byte, -1 when none in progress
+
+#endif
@@ -1,18 +1,27 @@
 #include <pic.h>
 #include <xc.h>
 #include "ps2_send.h"
+#include "keymap.h"
+#include "mouse.h"
 
 #define _XTAL_FREQ 20000000
 
-// Pin definitions (must match main.c)
-#define KBD_CLOCK      PORTBbits.RB0
-#define KBD_DATA       PORTBbits.RB4
-#define KBD_CLOCK_DIR  TRISBbits.TRISB0
-#define KBD_DATA_DIR   TRISBbits.TRISB4
+// Pin masks on PORTB/TRISB (must match main.c)
+#define KBD_CLOCK_MASK   0x01  // RB0
+#define KBD_DATA_MASK    0x10  // RB4
+#ifdef PS2_MOUSE
+#define MOUSE_CLOCK_MASK 0x80  // RB7
+#define MOUSE_DATA_MASK  0x04  // RB2
+#endif
 
-// Command queue - stores command ID and optional data
+// Command queue - command bytes, each followed by its data byte if it has one
+#ifndef CMD_BUFFER_SIZE
 #define CMD_BUFFER_SIZE 8
-#define CMD_BUFFER_MASK 0x07
+#endif
+#define CMD_BUFFER_MASK (CMD_BUFFER_SIZE - 1)
+#if CMD_BUFFER_SIZE & CMD_BUFFER_MASK
+#error "CMD_BUFFER_SIZE must be a power of two"
+#endif
 
 // Command IDs
 #define CMD_SET_LEDS      0xED
@@ -21,46 +30,63 @@
 #define CMD_ENABLE        0xF4
 #define CMD_DISABLE       0xF5
 #define CMD_SET_DEFAULTS  0xF6
+#define CMD_RESEND        0xFE
 #define CMD_RESET         0xFF
 
-typedef struct {
-    uint8_t cmd;   // Command byte
-    uint8_t data;  // Data byte (if needed)
-} PS2Command;
-
-static volatile PS2Command cmdBuffer[CMD_BUFFER_SIZE];
+static volatile uint8_t cmdBuffer[CMD_BUFFER_SIZE];
 static volatile uint8_t cmdHead = 0;
 static volatile uint8_t cmdTail = 0;
 
-// Transmission timeout flag (set by Timer0 ISR in main.c)
-volatile uint8_t tx_timeout = 0;
-
-// Echo monitoring flag (set by Timer1 ISR in main.c)
-volatile uint8_t echo_timeout = 0;
+// Flags shared with the ISR in main.c
+volatile uint8_t ps2_flags = 0;
 
-// Echo tracking
-static uint8_t echo_pending = 0;
-static uint8_t echo_failures = 0;
+// Command and echo tracking (cmd_state bits), main loop only
+// The ISR may queue commands, but never touches cmd_state
+#define SEND_DATA       0x01  // Command ACKed, send its data byte next
+#define RETRY_MASK      0x06  // Resend retries for the current command
+#define RETRY_ONE       0x02
+#define ECHO_PENDING    0x08
+#define ECHO_FAIL_MASK  0x30  // Consecutive echo failures
+#define ECHO_FAIL_ONE   0x10
+static uint8_t cmd_state = 0;
 
-// Queue a command structure
 #pragma warning push
 #pragma warning disable 1510
+static uint8_t hasData(uint8_t cmd) {
+    return cmd == CMD_SET_LEDS || cmd == CMD_SET_TYPEMATIC;
+}
+
+// Queue a command and its data byte, if it has one.
+// Both the ISR and the main loop queue commands, so interrupts are held off
+// (GIE is already clear in the ISR) or an ISR command written between our
+// bytes and cmdHead would leave the byte stream out of step.
 static void queueCommand(uint8_t cmd, uint8_t data) {
-    uint8_t nextHead = (cmdHead + 1) & CMD_BUFFER_MASK;
-    if (nextHead != cmdTail) {
-        cmdBuffer[cmdHead].cmd = cmd;
-        cmdBuffer[cmdHead].data = data;
-        cmdHead = nextHead;
+    uint8_t gie = INTCONbits.GIE;
+    INTCONbits.GIE = 0;
+
+    uint8_t head = cmdHead;
+    uint8_t space = (cmdTail - head - 1) & CMD_BUFFER_MASK;
+    if (space >= (hasData(cmd) ? 2 : 1)) {
+        cmdBuffer[head] = cmd;
+        head = (head + 1) & CMD_BUFFER_MASK;
+        if (hasData(cmd)) {
+            cmdBuffer[head] = data;
+            head = (head + 1) & CMD_BUFFER_MASK;
+        }
+        cmdHead = head;
     }
+
+    INTCONbits.GIE = gie;
 }
-#pragma warning pop
 
+// Command functions are called from both the ISR (lock keys, BAT, BAT fail)
+// and the main loop (startup, echo)
 void ps2_setLEDs(uint8_t leds) {
     queueCommand(CMD_SET_LEDS, leds);
 }
 void ps2_echo(void) {
     queueCommand(CMD_ECHO, 0);
-    echo_pending = 1;
+    cmd_state |= ECHO_PENDING;
 }
 void ps2_setTypematic(uint8_t rate) {
     queueCommand(CMD_SET_TYPEMATIC, rate);
@@ -75,17 +101,15 @@ void ps2_setDefaults(void) {
     queueCommand(CMD_SET_DEFAULTS, 0);
 }
 
+// Echo tracking starts over when the reset is sent (ps2_processCommands)
 void ps2_reset(void) {
     queueCommand(CMD_RESET, 0);
-    echo_pending = 0;
-    echo_failures = 0;
 }
 
 void ps2_initKeyboard(void) {
-    // Turn off all LEDs initially
-    ps2_setLEDs(0x00);
+    ps2_flags |= PS2_KBD_RESET;
 
-    // Enable numlock LED
+    // Numlock LED on, others off
     ps2_setLEDs(0x02);
 
     // Set typematic: 500ms delay, 30 reports/sec
@@ -96,184 +120,240 @@ void ps2_initKeyboard(void) {
     // Enable keyboard scanning
     ps2_enable();
 }
+#pragma warning pop
 
-static uint8_t ps2_sendByte(uint8_t data) {
+// Line access for the channel being driven (masks on PORTB/TRISB)
+#define CLOCK          (PORTB & clk)
+#define DATA           (PORTB & dat)
+#define TX_TIMEOUT     (ps2_flags & PS2_TX_TIMEOUT)
+#define SET_DATA(bit)  do { if (bit) PORTB |= dat; else PORTB &= ~dat; } while (0)
+
+// Send a byte on one PS/2 channel and return the device's response.
+// The other channel (if any) is inhibited by holding its clock low.
+static uint8_t ps2_sendFrame(uint8_t data, uint8_t clk, uint8_t dat, uint8_t inhibit) {
     uint8_t parity = 1;  // Odd parity starts at 1
     uint8_t response = 0;
 
     INTCONbits.INTE = 0;
+#ifdef PS2_MOUSE
+    INTCONbits.RBIE = 0;
+#endif
+    PORTB &= ~inhibit;
+    TRISB &= ~inhibit;
 
     // Request to send sequence
-    KBD_CLOCK_DIR = 0;  // Output
-    KBD_CLOCK = 0;
+    PORTB &= ~clk;
+    TRISB &= ~clk;      // Output low
     __delay_us(120);
-    KBD_DATA_DIR = 0;   // Output
-    KBD_DATA = 0;
-    KBD_CLOCK_DIR = 1;  // Input
+    PORTB &= ~dat;
+    TRISB &= ~dat;      // Output low
+    TRISB |= clk;       // Input
 
     // Wait for device to bring Clock low
-    tx_timeout = 0;
+    ps2_flags &= ~PS2_TX_TIMEOUT;
     TMR0 = 22;
     INTCONbits.TMR0IF = 0;
-    while (KBD_CLOCK && !tx_timeout);
-    if (tx_timeout) goto cleanup;
+    while (CLOCK && !TX_TIMEOUT);
+    if (TX_TIMEOUT) goto cleanup;
 
     // Send 8 data bits
     for (uint8_t i = 0; i < 8; i++) {
         uint8_t bit = (data >> i) & 1;
-        KBD_DATA = bit;                     // Setup data
+        SET_DATA(bit);                      // Setup data
         if (bit) parity ^= 1;
 
-        while (!KBD_CLOCK && !tx_timeout);  // Wait for Clock high
-        if (tx_timeout) goto cleanup;
+        while (!CLOCK && !TX_TIMEOUT);  // Wait for Clock high
+        if (TX_TIMEOUT) goto cleanup;
         TMR0 = 22;
         INTCONbits.TMR0IF = 0;
 
-        while (KBD_CLOCK && !tx_timeout);   // Wait for Clock low
-        if (tx_timeout) goto cleanup;
+        while (CLOCK && !TX_TIMEOUT);   // Wait for Clock low
+        if (TX_TIMEOUT) goto cleanup;
     }
 
-    KBD_DATA = parity;                      // Setup parity bit
-    while (!KBD_CLOCK && !tx_timeout);      // Wait high
-    if (tx_timeout) goto cleanup;
+    SET_DATA(parity);                       // Setup parity bit
+    while (!CLOCK && !TX_TIMEOUT);      // Wait high
+    if (TX_TIMEOUT) goto cleanup;
     TMR0 = 22;
     INTCONbits.TMR0IF = 0;
-    while (KBD_CLOCK && !tx_timeout);       // Wait low
-    if (tx_timeout) goto cleanup;
+    while (CLOCK && !TX_TIMEOUT);       // Wait low
+    if (TX_TIMEOUT) goto cleanup;
 
     // Release Data line
-    KBD_DATA_DIR = 1;  // Input
+    TRISB |= dat;      // Input
 
     // Wait for device ACK (Data low)
-    while (!KBD_CLOCK && !tx_timeout);      // Wait high
-    if (tx_timeout) goto cleanup;
+    while (!CLOCK && !TX_TIMEOUT);      // Wait high
+    if (TX_TIMEOUT) goto cleanup;
     TMR0 = 22;
     INTCONbits.TMR0IF = 0;
-    while (KBD_CLOCK && !tx_timeout);       // Wait low
-    if (tx_timeout) goto cleanup;
+    while (CLOCK && !TX_TIMEOUT);       // Wait low
+    if (TX_TIMEOUT) goto cleanup;
 
     // Wait for device to release Data and Clock
-    while ((!KBD_CLOCK || !KBD_DATA) && !tx_timeout);
-    if (tx_timeout) goto cleanup;
+    while ((!CLOCK || !DATA) && !TX_TIMEOUT);
+    if (TX_TIMEOUT) goto cleanup;
+
+    // Resend has no reply of its own: the byte it asks for arrives as a
+    // normal frame once the ISR is listening again
+    if (data == CMD_RESEND) goto cleanup;
 
     // Receive response byte
-    tx_timeout = 0;
+    ps2_flags &= ~PS2_TX_TIMEOUT;
     TMR0 = 22;
     INTCONbits.TMR0IF = 0;
 
-    while (KBD_CLOCK && !tx_timeout);          // Wait for Clock low
-    if (tx_timeout || KBD_DATA) goto cleanup;  // Start bit must be 0
+    while (CLOCK && !TX_TIMEOUT);          // Wait for Clock low
+    if (TX_TIMEOUT || DATA) goto cleanup;  // Start bit must be 0
 
     // Read 8 data bits
     for (uint8_t i = 0; i < 8; i++) {
-        while (!KBD_CLOCK && !tx_timeout);     // Wait Clock high
-        if (tx_timeout) goto cleanup;
-        while (KBD_CLOCK && !tx_timeout);      // Wait Clock low
-        if (tx_timeout) goto cleanup;
+        while (!CLOCK && !TX_TIMEOUT);     // Wait Clock high
+        if (TX_TIMEOUT) goto cleanup;
+        while (CLOCK && !TX_TIMEOUT);      // Wait Clock low
+        if (TX_TIMEOUT) goto cleanup;
         TMR0 = 22;
         INTCONbits.TMR0IF = 0;
 
-        response |= ((KBD_DATA & 1) << i);
+        response |= (uint8_t)((DATA ? 1 : 0) << i);
     }
 
     // Read parity bit
-    while (!KBD_CLOCK && !tx_timeout);         // Wait Clock high
-    if (tx_timeout) goto cleanup;
-    while (KBD_CLOCK && !tx_timeout);          // Wait Clock low
-    if (tx_timeout) goto cleanup;
+    while (!CLOCK && !TX_TIMEOUT);         // Wait Clock high
+    if (TX_TIMEOUT) goto cleanup;
+    while (CLOCK && !TX_TIMEOUT);          // Wait Clock low
+    if (TX_TIMEOUT) goto cleanup;
 
     // Read stop bit
-    while (!KBD_CLOCK && !tx_timeout);         // Wait Clock high
-    if (tx_timeout) goto cleanup;
-    while (KBD_CLOCK && !tx_timeout);          // Wait Clock low
+    while (!CLOCK && !TX_TIMEOUT);         // Wait Clock high
+    if (TX_TIMEOUT) goto cleanup;
+    while (CLOCK && !TX_TIMEOUT);          // Wait Clock low
 
 cleanup:
     // Restore pins to input mode
-    KBD_CLOCK_DIR = 1;
-    KBD_DATA_DIR = 1;
+    TRISB |= clk | dat | inhibit;
 
     // Re-enable kb_clock interrupt
     INTCONbits.INTF = 0;
     INTCONbits.INTE = 1;
+#ifdef PS2_MOUSE
+    mouse_resync();
+    INTCONbits.RBIE = 1;
+#endif
+
+    return TX_TIMEOUT ? 0xFF : response;
+}
 
-    return tx_timeout ? 0xFF : response;
+#undef CLOCK
+#undef DATA
+#undef TX_TIMEOUT
+#undef SET_DATA
+
+static uint8_t ps2_sendByte(uint8_t data) {
+#ifdef PS2_MOUSE
+    return ps2_sendFrame(data, KBD_CLOCK_MASK, KBD_DATA_MASK, MOUSE_CLOCK_MASK);
+#else
+    return ps2_sendFrame(data, KBD_CLOCK_MASK, KBD_DATA_MASK, 0);
+#endif
+}
+
+#ifdef PS2_MOUSE
+uint8_t ps2_sendMouseByte(uint8_t data) {
+    return ps2_sendFrame(data, MOUSE_CLOCK_MASK, MOUSE_DATA_MASK, KBD_CLOCK_MASK);
+}
+#endif
+
+uint8_t ps2_commandsPending(void) {
+    return cmdHead != cmdTail || (ps2_flags & (PS2_ECHO_TIMEOUT | PS2_RESEND));
+}
+
+// Move on to the next queued command
+static void nextCommand(uint8_t cmd) {
+    cmdTail = (cmdTail + (hasData(cmd) ? 2 : 1)) & CMD_BUFFER_MASK;
+    cmd_state &= ~(SEND_DATA | RETRY_MASK);
 }
 
 void ps2_processCommands(void) {
-    static uint8_t retry_count = 0;
-    static uint8_t state = 0;  // 0=send_cmd, 1=send_data
+    // Any frame from the keyboard proves it is there - forget old echo failures
+    if (ps2_flags & PS2_KBD_ALIVE) {
+        ps2_flags &= ~PS2_KBD_ALIVE;
+        cmd_state &= ~ECHO_FAIL_MASK;
+    }
+
+#ifdef IDLE_SLEEP
+    // Ask for a frame lost while waking before sending anything else, since
+    // the keyboard resends the last byte it sent. Not between a command and
+    // its data byte, the keyboard is waiting for the data then.
+    if ((ps2_flags & PS2_RESEND) && !(cmd_state & SEND_DATA)) {
+        ps2_flags &= ~PS2_RESEND;
+        ps2_sendByte(CMD_RESEND);
+        return;
+    }
+#endif
 
     // Check for echo timeout
-    if (echo_timeout) {
-        echo_timeout = 0;
-        if (!echo_pending) {
+    if (ps2_flags & PS2_ECHO_TIMEOUT) {
+        ps2_flags &= ~PS2_ECHO_TIMEOUT;
+        if (!(cmd_state & ECHO_PENDING)) {
             ps2_echo();
         }
     }
 
     if (cmdHead != cmdTail) {
-        PS2Command* current = (PS2Command*)&cmdBuffer[cmdTail];
+        uint8_t cmd = cmdBuffer[cmdTail];
+        uint8_t retry = (cmd_state & RETRY_MASK) < 2 * RETRY_ONE;
 
-        if (state == 0) {
+        if (!(cmd_state & SEND_DATA)) {
             // Send command byte
-            uint8_t response = ps2_sendByte(current->cmd);
+            uint8_t response = ps2_sendByte(cmd);
+            if (cmd == CMD_RESET) {
+                cmd_state &= ~(ECHO_PENDING | ECHO_FAIL_MASK);
+            }
 
-            if (response == 0xFE && retry_count < 2) {
+            if (response == 0xFE && retry) {
                 // Resend request - retry from start
-                retry_count++;
+                cmd_state += RETRY_ONE;
                 return;
             } else if (response != 0xFA && response != 0xEE) {
                 // Error or timeout - handle based on command
-                if (current->cmd == CMD_ECHO) {
-                    echo_pending = 0;
-                    echo_failures++;
-                    if (echo_failures >= 3) {
+                if (cmd == CMD_ECHO) {
+                    cmd_state &= ~ECHO_PENDING;
+                    cmd_state += ECHO_FAIL_ONE;
+                    if ((cmd_state & ECHO_FAIL_MASK) == ECHO_FAIL_MASK) {
+                        releaseAllKeys();
                         ps2_reset();
                     }
                 }
-                cmdTail = (cmdTail + 1) & CMD_BUFFER_MASK;
-                retry_count = 0;
-                state = 0;
+                nextCommand(cmd);
                 return;
             }
 
             // Handle echo response
-            if (current->cmd == CMD_ECHO && response == 0xEE) {
-                echo_pending = 0;
-                echo_failures = 0;
+            if (cmd == CMD_ECHO && response == 0xEE) {
+                cmd_state &= ~(ECHO_PENDING | ECHO_FAIL_MASK);
             }
 
             // Command ACKed - check if we need to send data
-            if (current->cmd == CMD_SET_LEDS || current->cmd == CMD_SET_TYPEMATIC) {
-                state = 1;  // Need to send data byte
+            if (hasData(cmd)) {
+                cmd_state |= SEND_DATA;  // Need to send data byte
                 return;
             }
 
             // Single-byte command complete
-            cmdTail = (cmdTail + 1) & CMD_BUFFER_MASK;
-            retry_count = 0;
-            state = 0;
+            nextCommand(cmd);
         } else {
             // Send data byte
-            uint8_t response = ps2_sendByte(current->data);
+            uint8_t response = ps2_sendByte(cmdBuffer[(cmdTail + 1) & CMD_BUFFER_MASK]);
 
-            if (response == 0xFE && retry_count < 2) {
+            if (response == 0xFE && retry) {
                 // Resend entire command+data
-                retry_count++;
-                state = 0;  // Restart from command byte
-                return;
-            } else if (response != 0xFA) {
-                // Error - skip command
-                cmdTail = (cmdTail + 1) & CMD_BUFFER_MASK;
-                retry_count = 0;
-                state = 0;
+                cmd_state += RETRY_ONE;
+                cmd_state &= ~SEND_DATA;  // Restart from command byte
                 return;
             }
 
-            // Data byte ACKed - command complete
-            cmdTail = (cmdTail + 1) & CMD_BUFFER_MASK;
-            retry_count = 0;
-            state = 0;
+            // Data byte ACKed (command complete) or error (skip command)
+            nextCommand(cmd);
         }
     }
 }
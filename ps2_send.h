@@ -3,11 +3,14 @@
 
 #include <stdint.h>
 
-// Transmission timeout flag (set by Timer0 ISR when INTE disabled)
-extern volatile uint8_t tx_timeout;
-
-// Echo monitoring flag (set by Timer1 ISR)
-extern volatile uint8_t echo_timeout;
+// Flags shared with the ISR, packed into one byte. Only set or clear one bit
+// at a time (atomic bsf/bcf) outside the ISR.
+extern volatile uint8_t ps2_flags;
+#define PS2_TX_TIMEOUT   0x01  // Transmission timeout (set by Timer0 ISR when INTE disabled)
+#define PS2_ECHO_TIMEOUT 0x02  // Echo due (set by Timer0 ISR)
+#define PS2_KBD_RESET    0x04  // Keyboard initialized after BAT (cleared by main loop)
+#define PS2_KBD_ALIVE    0x08  // Valid frame received (set by ISR, cleared by main loop)
+#define PS2_RESEND       0x10  // Frame lost while waking, ask for it again (IDLE_SLEEP)
 
 // PS/2 command functions
 void ps2_setLEDs(uint8_t leds);            // 0xED: Set LEDs (bit 0=scroll, 1=num, 2=caps)
@@ -17,9 +20,15 @@ void ps2_enable(void);                     // 0xF4: Enable scanning
 void ps2_disable(void);                    // 0xF5: Disable scanning
 void ps2_setDefaults(void);                // 0xF6: Set default parameters
 void ps2_reset(void);                      // 0xFF: Reset keyboard
-void ps2_initKeyboard(void);               // Initialize keyboard: LEDs off, numlock on, typematic 500ms/30Hz
+void ps2_initKeyboard(void);               // Initialize keyboard: numlock LED on, typematic 500ms/30Hz
 
 // Process command queue (call from main loop)
 void ps2_processCommands(void);
+uint8_t ps2_commandsPending(void);         // Commands queued or echo due
+
+#ifdef PS2_MOUSE
+// Send a byte to the mouse and return its response (0xFF on timeout)
+uint8_t ps2_sendMouseByte(uint8_t data);
+#endif
 
 #endif